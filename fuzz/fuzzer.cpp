@@ -0,0 +1,305 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <string.h>
+#include "../src/cpu.hpp"
+
+//coverage guided fuzzer for the CPU
+//it mutates keypad input sequences (and optionally the ROM itself), runs them in a persistent loop
+//on a single CPU object and keeps every input that reaches a new edge in the coverage bitmap.
+//inputs that crash the CPU are written to the output directory instead of killing the process.
+
+//an input is a list of keypad states, 2 bytes each, one bit per key
+//each keypad state is held for KEY_HOLD_CYCLES instructions
+#define KEY_HOLD_CYCLES 32
+#define MAX_KEY_STEPS 64
+
+struct Input{
+    std::vector<uint8_t> keys;
+    std::vector<uint8_t> rom;
+};
+
+//execution trace of the current run and the edges we have not seen yet
+//the trace is stored as 64 bit words so that hasNewCoverage() can skip empty parts 8 bytes at a time,
+//the CPU writes to it through a byte view, which is allowed for any type
+uint64_t traceWords[COVERAGE_SIZE / 8];
+uint8_t *trace = (uint8_t*)traceWords;
+uint8_t virgin[COVERAGE_SIZE];
+
+//hit counts are bucketed like AFL does, so that a loop running 4 times instead of 3 counts as new coverage
+//but 100 times instead of 101 doesn't
+uint8_t bucket[256];
+
+//unique crashes, identified by type and address
+std::vector<uint32_t> crashes;
+
+//xorshift random number generator, rand() is too slow to drive the mutator
+uint64_t rngState = 0x2545F4914F6CDD1DULL;
+
+uint32_t rng(){
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return (uint32_t)(rngState >> 32);
+}
+
+void initBuckets(){
+    bucket[0] = 0;
+    bucket[1] = 1;
+    bucket[2] = 2;
+    bucket[3] = 4;
+    for(int i=4; i<256; i++){
+        if(i < 8)        bucket[i] = 8;
+        else if(i < 16)  bucket[i] = 16;
+        else if(i < 32)  bucket[i] = 32;
+        else if(i < 128) bucket[i] = 64;
+        else             bucket[i] = 128;
+    }
+}
+
+//returns true if the last run reached an edge or a hit count bucket we have not seen before
+bool hasNewCoverage(){
+    bool found = false;
+    for(int w=0; w<COVERAGE_SIZE/8; w++){
+        //most of the bitmap is empty, skip 8 bytes at a time
+        if(traceWords[w] == 0)
+            continue;
+
+        for(int i=w*8; i<w*8+8; i++){
+            uint8_t b = bucket[trace[i]];
+            if(b & virgin[i]){
+                virgin[i] &= ~b;
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+int countEdges(){
+    int edges = 0;
+    for(int i=0; i<COVERAGE_SIZE; i++){
+        if(virgin[i] != 0xFF)
+            edges++;
+    }
+    return edges;
+}
+
+//reset the CPU and run one input, the coverage of the run ends up in trace
+//with check_hash, the incremental state hash is compared against a full rehash after every instruction.
+//a mismatch means some write skipped CPU::writeMemory or the frame hash, so stop right there
+void run(CPU &cpu, const Input &input, bool check_hash){
+    memset(traceWords, 0, sizeof(traceWords));
+
+    cpu.loadROM(input.rom.data(), (int)input.rom.size());
+
+    int steps = (int)input.keys.size() / 2;
+    if(steps == 0)
+        steps = 1;
+
+    for(int step=0; step<steps; step++){
+        uint16_t mask = 0;
+        if(step*2 + 1 < (int)input.keys.size())
+            mask = input.keys[step*2] | (input.keys[step*2 + 1] << 8);
+
+        for(int i=0; i<16; i++){
+            cpu.keypad[i] = (mask >> i) & 1;
+        }
+
+        for(int i=0; i<KEY_HOLD_CYCLES; i++){
+            cpu.execute();
+
+            if(check_hash && cpu.stateHash() != cpu.computeStateHash()){
+                fprintf(stderr, "state hash mismatch at step %d, instruction %d\n", step, i);
+                abort();
+            }
+        }
+
+        if(cpu.crash != CRASH_NONE)
+            return;
+    }
+}
+
+void mutate(Input &input, bool mutate_rom){
+    int count = 1 + (rng() % 8);
+
+    for(int n=0; n<count; n++){
+        //ROM mutations only make sense for ROM bytes, pick either the ROM or the keys
+        if(mutate_rom && !input.rom.empty() && (rng() & 1)){
+            size_t pos = rng() % input.rom.size();
+            if(rng() & 1)
+                input.rom[pos] ^= 1 << (rng() % 8);
+            else
+                input.rom[pos] = (uint8_t)rng();
+            continue;
+        }
+
+        switch(rng() % 5){
+            //flip a single key in one step
+            case 0:
+                if(!input.keys.empty())
+                    input.keys[rng() % input.keys.size()] ^= 1 << (rng() % 8);
+                break;
+
+            //replace a whole keypad state
+            case 1:
+                if(!input.keys.empty())
+                    input.keys[rng() % input.keys.size()] = (uint8_t)rng();
+                break;
+
+            //insert a new step
+            case 2:
+                if(input.keys.size() < MAX_KEY_STEPS*2){
+                    size_t pos = (rng() % (input.keys.size()/2 + 1)) * 2;
+                    uint16_t mask = (uint16_t)(1 << (rng() % 16));
+                    input.keys.insert(input.keys.begin() + pos, {(uint8_t)mask, (uint8_t)(mask >> 8)});
+                }
+                break;
+
+            //delete a step
+            case 3:
+                if(input.keys.size() >= 4){
+                    size_t pos = (rng() % (input.keys.size()/2)) * 2;
+                    input.keys.erase(input.keys.begin() + pos, input.keys.begin() + pos + 2);
+                }
+                break;
+
+            //hold the current keys for one more step
+            case 4:
+                if(input.keys.size() >= 2 && input.keys.size() < MAX_KEY_STEPS*2){
+                    size_t pos = (rng() % (input.keys.size()/2)) * 2;
+                    uint8_t lo = input.keys[pos], hi = input.keys[pos + 1];
+                    input.keys.insert(input.keys.begin() + pos, {lo, hi});
+                }
+                break;
+        }
+    }
+}
+
+void writeFile(const std::string &path, const std::vector<uint8_t> &data){
+    FILE *fp = fopen(path.c_str(), "wb");
+    if(fp == nullptr){
+        std::cerr << "Failed to write " << path << std::endl;
+        return;
+    }
+    fwrite(data.data(), 1, data.size(), fp);
+    fclose(fp);
+}
+
+//keys are always saved, the ROM only when it is being mutated
+void saveInput(const std::string &path, const Input &input, bool mutate_rom){
+    writeFile(path + ".keys", input.keys);
+    if(mutate_rom)
+        writeFile(path + ".ch8", input.rom);
+}
+
+int main(int argc, char *argv[]){
+    if(argc < 3){
+        std::cout << "Usage : fuzzer <ROM file> <output dir> [--rom] [--xochip] [--check-hash] [--execs N]" << std::endl;
+        return 1;
+    }
+
+    const char *out_dir = argv[2];
+    bool mutate_rom = false;
+    bool xochip = false;
+    bool check_hash = false;
+    long long max_execs = 0; //0 runs forever
+
+    for(int i=3; i<argc; i++){
+        if(strcmp(argv[i], "--rom") == 0)
+            mutate_rom = true;
+        else if(strcmp(argv[i], "--xochip") == 0)
+            xochip = true;
+        else if(strcmp(argv[i], "--check-hash") == 0)
+            check_hash = true;
+        else if(strcmp(argv[i], "--execs") == 0 && i + 1 < argc)
+            max_execs = atoll(argv[++i]);
+    }
+
+    //read the ROM once, every run reloads it from host memory
+    FILE *fp = fopen(argv[1], "rb");
+    if(fp == nullptr){
+        std::cerr << "Failed to open ROM" << std::endl;
+        return 2;
+    }
+    Input seed;
+    fseek(fp, 0, SEEK_END);
+    seed.rom.resize(ftell(fp));
+    fseek(fp, 0, SEEK_SET);
+    fread(seed.rom.data(), 1, seed.rom.size(), fp);
+    fclose(fp);
+
+    //start with nobody touching the keypad
+    seed.keys = {0, 0};
+
+    initBuckets();
+    memset(virgin, 0xFF, sizeof(virgin));
+
+    CPU cpu = CPU(xochip);
+    cpu.coverage = trace;
+
+    //mutations never change the size of the ROM, so if the seed fits, every run does
+    if(cpu.loadROM(seed.rom.data(), (int)seed.rom.size()) == -1)
+        return 2;
+
+    std::vector<Input> corpus;
+    run(cpu, seed, check_hash);
+    hasNewCoverage();
+    corpus.push_back(seed);
+    saveInput(std::string(out_dir) + "/queue_0", seed, mutate_rom);
+
+    auto start = std::chrono::steady_clock::now();
+    auto last_report = start;
+    long long execs = 0;
+
+    while(max_execs == 0 || execs < max_execs){
+        Input input = corpus[rng() % corpus.size()];
+        mutate(input, mutate_rom);
+        run(cpu, input, check_hash);
+        execs++;
+
+        if(cpu.crash != CRASH_NONE){
+            uint32_t id = ((uint32_t)cpu.crash << 16) | cpu.crashPC;
+            bool seen = false;
+            for(uint32_t c : crashes){
+                if(c == id)
+                    seen = true;
+            }
+
+            if(!seen){
+                crashes.push_back(id);
+
+                char name[64];
+                snprintf(name, sizeof(name), "/crash_%d_%.4X", (int)cpu.crash, cpu.crashPC);
+                saveInput(std::string(out_dir) + name, input, mutate_rom);
+
+                printf("new crash (%s) at %.4X, opcode: %.4X\n", crashName(cpu.crash), cpu.crashPC, cpu.crashOpcode);
+            }
+        }
+
+        //the edges of a crashed run still count, but the input is not kept,
+        //mutations of it would stop at the same crash and never get further
+        if(hasNewCoverage() && cpu.crash == CRASH_NONE){
+            saveInput(std::string(out_dir) + "/queue_" + std::to_string(corpus.size()), input, mutate_rom);
+            corpus.push_back(input);
+        }
+
+        //report progress about once a second, checking the clock every run would slow the loop down
+        if((execs & 0xFFF) == 0){
+            auto now = std::chrono::steady_clock::now();
+            if(now - last_report >= std::chrono::seconds(1)){
+                double seconds = std::chrono::duration<double>(now - start).count();
+                printf("execs: %lld (%.0f/s), corpus: %zu, edges: %d, crashes: %zu\n",
+                    execs, execs / seconds, corpus.size(), countEdges(), crashes.size());
+                last_report = now;
+            }
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("done, execs: %lld (%.0f/s), corpus: %zu, edges: %d, crashes: %zu\n",
+        execs, execs / seconds, corpus.size(), countEdges(), crashes.size());
+
+    return 0;
+}
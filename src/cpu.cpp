@@ -1,4 +1,5 @@
 #include <iostream>
+#include <string.h>
 #include "cpu.hpp"
 
 
@@ -24,9 +25,49 @@ unsigned char font[80] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  //F
 };
 
-//define functions of CPU class
-CPU::CPU(){
+//human readable names for CrashType, used when reporting crashes
+const char *crashName(CrashType type){
+    switch(type){
+        case CRASH_NONE:            return "none";
+        case CRASH_INVALID_OPCODE:  return "invalid opcode";
+        case CRASH_STACK_OVERFLOW:  return "stack overflow";
+        case CRASH_STACK_UNDERFLOW: return "stack underflow";
+    }
+    return "unknown";
+}
+
+//state hashing
+//every (location, value) pair gets its own 64 bit key and the hash of a state is the XOR of the keys of all its locations.
+//keys are computed with the splitmix64 finalizer instead of being stored in a table, a table for 4096 x 256 memory values would be 8 MB.
+//a zero byte or an unset pixel has the key 0, so clearing memory or the frame clears its hash too
+static inline uint64_t zobrist(uint64_t key){
+    key += 0x9E3779B97F4A7C15ULL;
+    key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+    return key ^ (key >> 31);
+}
+
+static inline uint64_t memoryKey(uint16_t address, uint8_t value){
+    return zobrist(((uint64_t)address << 8) | value) & (0 - (uint64_t)(value != 0));
+}
+
+static inline uint64_t frameKey(int index){
+    return zobrist(0x100000000ULL | index);
+}
 
+//registers are hashed with the same keys, but separated from memory and frame by the upper bits
+static inline uint64_t registerKey(uint64_t reg, uint32_t value){
+    return zobrist(((2 + reg) << 32) | value);
+}
+
+//define functions of CPU class
+CPU::CPU(bool xochip){
+    //only the two sizes are allowed, anything that isn't a power of 2 would break the address masking
+    memorySize = xochip ? MEMORY_SIZE_XOCHIP : MEMORY_SIZE_CHIP8;
+    memoryMask = memorySize - 1;
+    memory.resize(memorySize + MEMORY_PADDING);
+    coverage = nullptr; //no coverage tracking unless the fuzzer asks for it
+    crash = CRASH_NONE;
 }
 
 CPU::~CPU(){
@@ -44,11 +85,19 @@ void CPU::init(){
     opcode = 0; //opcode
     I = 0; //index register
     sp = 0; //stack pointer
+    prevLoc = 0; //start edge coverage from a clean location
+
+    //clear any crash from a previous run
+    crash = CRASH_NONE;
+    crashPC = 0;
+    crashOpcode = 0;
+    frameOverdraws = 0;
 
     //intialize the frame buffer or graphics
     for(int i=0; i<64*32; i++){
         frame[i] = 0;
     }
+    frameHash = 0; //an empty frame hashes to 0
 
     //clear the stack, keypad and registers
     for(int i=0; i<16; i++){
@@ -57,26 +106,90 @@ void CPU::init(){
         keypad[i] = 0;
     }
 
-    //clear the memory
-    for(int i=0; i<4096; i++){
-        memory[i] = 0;
-    }
+    //clear the memory and the mirrored padding after it
+    memset(memory.data(), 0, memory.size());
+    memoryHash = 0; //so does empty memory
 
     //now we have a memory of 4096 bytes, and we need to load the CHIP 8 interpreter upto 0x200
     //first, load the font into the memory
-    for(int i=0; i<80; i++){
-        memory[i] = font[i];
-    }
+    writeMemory(0, font, 80);
 
     //set sound and delay timers
     st = 0;
     dt = 0;
+
+    //every run of a ROM gets the same random numbers
+    rngState = 0x2545F491;
 }
 
-int CPU::loadROM(const char *rom_path){
-    //initialise the CPU
-    init(); //this sets all the required registers, memory and graphics buffer from 0x000 to 0x200
+//every write to memory goes through here, so that memoryHash and the mirrored padding stay up to date.
+//the address wraps around the end of memory, by at most MEMORY_PADDING bytes
+void CPU::writeMemory(uint16_t address, const uint8_t *data, int length){
+    uint32_t base = address & memoryMask;
+
+    //the padding mirrors the start of memory, so memory + base holds the old bytes even when they wrap
+    for(int i=0; i<length; i++){
+        uint16_t wrapped = (base + i) & memoryMask;
+        memoryHash ^= memoryKey(wrapped, memory[base + i]) ^ memoryKey(wrapped, data[i]);
+    }
+
+    memcpy(memory.data() + base, data, length);
+
+    //if the write ran into the padding, copy the padding to the start of memory, otherwise copy the start to the padding
+    //in case the write was there. whichever way, the copy is a no-op for the bytes that didn't change
+    uint32_t spilled = (base + length) > memorySize;
+    memcpy(memory.data() + memorySize * (spilled ^ 1), memory.data() + memorySize * spilled, MEMORY_PADDING);
+}
+
+//registers are only a few dozen bytes, so they are hashed when asked for instead of on every write
+uint64_t CPU::registerHash() const{
+    uint64_t hash = 0;
+
+    for(int i=0; i<16; i++){
+        hash ^= registerKey(i, V[i]);
+        hash ^= registerKey(16 + i, stack[i]);
+    }
+
+    hash ^= registerKey(32, pc);
+    hash ^= registerKey(33, I);
+    hash ^= registerKey(34, sp);
+    hash ^= registerKey(35, dt);
+    hash ^= registerKey(36, st);
+    hash ^= registerKey(37, rngState);
+
+    return hash;
+}
+
+//hash of the whole CPU state, two CPUs with the same hash are in the same state (with very high probability)
+//memory and frame are hashed incrementally, so this only has to hash the registers
+uint64_t CPU::stateHash() const{
+    return memoryHash ^ frameHash ^ registerHash();
+}
+
+//same as stateHash, but rehashes memory and frame from scratch. this is slow, use it to check the incremental hashes
+uint64_t CPU::computeStateHash() const{
+    uint64_t memory_hash = 0;
+    for(uint32_t i=0; i<memorySize; i++){
+        memory_hash ^= memoryKey(i, memory[i]);
+    }
 
+    uint64_t frame_hash = 0;
+    for(int i=0; i<64*32; i++){
+        if(frame[i] != 0)
+            frame_hash ^= frameKey(i);
+    }
+
+    return memory_hash ^ frame_hash ^ registerHash();
+}
+
+//record why the CPU stopped, so that the caller can decide what to do with it
+void CPU::trap(CrashType type){
+    crash = type;
+    crashPC = pc;
+    crashOpcode = opcode;
+}
+
+int CPU::loadROM(const char *rom_path){
     std::cout << "Loading ROM into memory" << std::endl;
 
     //open the specified rom
@@ -100,25 +213,35 @@ int CPU::loadROM(const char *rom_path){
     //if the allocation was successful, then copy the ROM file contents into the buffer
     fread(buffer, sizeof(char), (size_t)rom_size, fp);
 
-    //once the contents of ROM are stored in the buffer, load it into the chip memory after 0x200 or after 512 bytes of memory
-    //and this is only possible if rom_size is less than 4096 - 512
-    if(rom_size < (4096-512)){
-        for(int i=0; i<rom_size; i++){
-            memory[512+i] = (uint8_t)buffer[i];
-        }
+    //load the buffer into the chip memory
+    int status = loadROM((const uint8_t*)buffer, rom_size);
+
+    //close the file and free the buffer to prevent memory leaks
+    fclose(fp);
+    free(buffer);
+
+    return status;
+}
+
+//load a ROM that is already in host memory. this does no file I/O, so the fuzzer uses it to reset the CPU between runs
+int CPU::loadROM(const uint8_t *rom, int rom_size){
+    //initialise the CPU
+    init(); //this sets all the required registers, memory and graphics buffer from 0x000 to 0x200
+
+    //load the ROM into the chip memory after 0x200 or after 512 bytes of memory
+    //and this is only possible if rom_size is less than memorySize - 512
+    if(rom_size < (int)(memorySize-512)){
+        writeMemory(512, rom, rom_size);
     }
     else{
         std::cerr << "ROM file size is too large, cannot fit into memory." << std::endl;
+        return -1;
     }
 
     //we have set up everything from 0x000 to 0x200 in the init function and
     //we have also loaded our ROM into memory from 0x200 to 0xFFF.
     //all, we have to do is execute this loaded memory with the help of program counter by moving it back and forth
 
-    //close the file and free the buffer to prevent memory leaks
-    fclose(fp);
-    free(buffer);
-
     //as everything went fine, return true
     return 0;
 }
@@ -126,6 +249,10 @@ int CPU::loadROM(const char *rom_path){
 //shamelessly copied this giant switch statement from https://github.com/JamesGriffin/CHIP-8-Emulator
 //fetch and execute instructions from 0x200 to 0x4096 from memory using program counter
 void CPU::execute(){
+    //a crashed CPU stays crashed until the next loadROM
+    if(crash != CRASH_NONE)
+        return;
+
     //on CHIP 8, each instruction is 2 bytes long
     
     //the program counter is currently at 0x200, fetch instructions from 0x200 with the help of program counter
@@ -139,9 +266,19 @@ void CPU::execute(){
     //opcode = memory[pc] << 8 | memory[pc+1];
 
     //or we can do this directly as follows
-    opcode = memory[pc + 0]; //fetch the opcode from pc
+    //BNNN can jump past the end of memory, so pc is wrapped. the second byte may be in the padding, which mirrors the start
+    opcode = memory[(pc & memoryMask) + 0]; //fetch the opcode from pc
     opcode = opcode << 8; //left shift it
-    opcode = opcode | memory[pc+1]; //fetch the next opcode and OR it with the next 8 bits of opcode
+    opcode = opcode | memory[(pc & memoryMask) + 1]; //fetch the next opcode and OR it with the next 8 bits of opcode
+
+    //record the edge from the previous instruction to this one in the coverage bitmap
+    //the location is shifted so that A -> B and B -> A end up in different buckets
+    //pc is wrapped the same way as the fetch, so aliases of the same address count as the same location
+    if(coverage != nullptr){
+        uint16_t loc = (uint16_t)((pc & memoryMask) * 0x9E37);
+        coverage[(loc ^ prevLoc) & (COVERAGE_SIZE - 1)]++;
+        prevLoc = loc >> 1;
+    }
 
     //decode and execute the fetched instruction from memory using the following giant switch statement
     switch (opcode & 0xF000)
@@ -153,20 +290,25 @@ void CPU::execute(){
                     for(int i=0; i<64*32; i++){
                         frame[i] = 0;
                     }
+                    frameHash = 0;
                     drawFlag = true;
                     pc += 2;
                     break;
                 
                 //0x00EE - return from subroutine
                 case 0x000E:
+                    if(sp == 0){
+                        trap(CRASH_STACK_UNDERFLOW);
+                        return;
+                    }
                     --sp;
-                    pc = stack[sp];
+                    pc = stack[sp & 0xF];
                     pc += 2;
                     break;
                 
                 default:
-                    printf("Invalid opcode : %.4x\n", opcode);
-                    exit(1);
+                    trap(CRASH_INVALID_OPCODE);
+                    return;
             }
             break;
         
@@ -177,7 +319,11 @@ void CPU::execute(){
 
         //0x2NNN - call the subroutine at NNN
         case 0x2000:
-            stack[sp] = pc;
+            if(sp >= 16){
+                trap(CRASH_STACK_OVERFLOW);
+                return;
+            }
+            stack[sp & 0xF] = pc;
             ++sp;
             pc = opcode & 0x0FFF; //decode the opcode using 0xFFF, so that we get the 12 bits
             break;
@@ -297,8 +443,8 @@ void CPU::execute(){
                     break;
 
                 default:
-                    printf("\nUnknown op code: %.4X\n", opcode);
-                    exit(3);
+                    trap(CRASH_INVALID_OPCODE);
+                    return;
             }
             break;
 
@@ -323,7 +469,11 @@ void CPU::execute(){
 
         // CXNN - Sets VX to a random number, masked by NN.
         case 0xC000:
-            V[(opcode & 0x0F00) >> 8] = (rand() % (0xFF + 1)) & (opcode & 0x00FF);
+            //xorshift32, rand() would live outside the CPU and break save states
+            rngState ^= rngState << 13;
+            rngState ^= rngState >> 17;
+            rngState ^= rngState << 5;
+            V[(opcode & 0x0F00) >> 8] = (rngState >> 24) & (opcode & 0x00FF);
             pc += 2;
             break;
 
@@ -342,19 +492,29 @@ void CPU::execute(){
             unsigned short height = opcode & 0x000F;
             unsigned short pixel;
 
+            //sprites are at most 15 bytes, so they fit in the padding if they run past the end of memory
+            const uint8_t *sprite = memory.data() + (I & memoryMask);
+
             V[0xF] = 0;
             for (int yline = 0; yline < height; yline++)
             {
-                pixel = memory[I + yline];
+                pixel = sprite[yline];
                 for(int xline = 0; xline < 8; xline++)
                 {
                     if((pixel & (0x80 >> xline)) != 0)
                     {
+                        //sprites drawn past the bottom right corner would write outside the frame buffer, clip them
+                        if(x + xline + ((y + yline) * 64) >= 64*32){
+                            frameOverdraws++;
+                            continue;
+                        }
+
                         if(frame[(x + xline + ((y + yline) * 64))] == 1)
                         {
                             V[0xF] = 1;
                         }
                         frame[x + xline + ((y + yline) * 64)] ^= 1;
+                        frameHash ^= frameKey(x + xline + ((y + yline) * 64));
                     }
                 }
             }
@@ -371,7 +531,7 @@ void CPU::execute(){
                 // EX9E - Skips the next instruction if the key stored
                 // in VX is pressed.
                 case 0x009E:
-                    if (keypad[V[(opcode & 0x0F00) >> 8]] != 0)
+                    if (keypad[V[(opcode & 0x0F00) >> 8] & 0xF] != 0)
                         pc +=  4;
                     else
                         pc += 2;
@@ -380,15 +540,15 @@ void CPU::execute(){
                 // EXA1 - Skips the next instruction if the key stored
                 // in VX isn't pressed.
                 case 0x00A1:
-                    if (keypad[V[(opcode & 0x0F00) >> 8]] == 0)
+                    if (keypad[V[(opcode & 0x0F00) >> 8] & 0xF] == 0)
                         pc +=  4;
                     else
                         pc += 2;
                     break;
 
                 default:
-                    printf("\nUnknown op code: %.4X\n", opcode);
-                    exit(3);
+                    trap(CRASH_INVALID_OPCODE);
+                    return;
             }
             break;
 
@@ -459,16 +619,19 @@ void CPU::execute(){
                 // FX33 - Stores the Binary-coded decimal representation of VX
                 // at the addresses I, I plus 1, and I plus 2
                 case 0x0033:
-                    memory[I]     = V[(opcode & 0x0F00) >> 8] / 100;
-                    memory[I + 1] = (V[(opcode & 0x0F00) >> 8] / 10) % 10;
-                    memory[I + 2] = V[(opcode & 0x0F00) >> 8] % 10;
+                {
+                    uint8_t bcd[3];
+                    bcd[0] = V[(opcode & 0x0F00) >> 8] / 100;
+                    bcd[1] = (V[(opcode & 0x0F00) >> 8] / 10) % 10;
+                    bcd[2] = V[(opcode & 0x0F00) >> 8] % 10;
+                    writeMemory(I, bcd, 3);
                     pc += 2;
+                }
                     break;
 
                 // FX55 - Stores V0 to VX in memory starting at address I
                 case 0x0055:
-                    for (int i = 0; i <= ((opcode & 0x0F00) >> 8); ++i)
-                        memory[I + i] = V[i];
+                    writeMemory(I, V, ((opcode & 0x0F00) >> 8) + 1);
 
                     // On the original interpreter, when the
                     // operation is done, I = I + X + 1.
@@ -476,9 +639,10 @@ void CPU::execute(){
                     pc += 2;
                     break;
 
+                // FX65 - Fills V0 to VX with values from memory starting at address I
                 case 0x0065:
-                    for (int i = 0; i <= ((opcode & 0x0F00) >> 8); ++i)
-                        V[i] = memory[I + i];
+                    //at most 16 bytes, so this can read from the padding instead of wrapping
+                    memcpy(V, memory.data() + (I & memoryMask), ((opcode & 0x0F00) >> 8) + 1);
 
                     // On the original interpreter,
                     // when the operation is done, I = I + X + 1.
@@ -487,13 +651,14 @@ void CPU::execute(){
                     break;
 
                 default:
-                    printf ("Unknown opcode [0xF000]: 0x%X\n", opcode);
+                    trap(CRASH_INVALID_OPCODE);
+                    return;
             }
             break;
 
         default:
-            printf("\nUnimplemented opcode: %.4X\n", opcode);
-            exit(3);
+            trap(CRASH_INVALID_OPCODE);
+            return;
     }
 
     // Update timers
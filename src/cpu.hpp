@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <vector>
 
 /*
 Memory Map:
@@ -28,12 +29,35 @@ Memory Map:
 +---------------+= 0x000 (0) Start of Chip-8 RAM
 */
 
+//memory sizes of the two supported machines, both are powers of 2 so that addresses can be masked instead of checked
+#define MEMORY_SIZE_CHIP8 4096
+#define MEMORY_SIZE_XOCHIP 65536
+
+//bytes after the end of memory that mirror its first bytes, so that reads of up to 16 bytes
+//that run past the end (DXYN, FX65, opcode fetch) can read straight from memory without wrapping each address
+#define MEMORY_PADDING 16
+
+//size of the edge coverage bitmap used by the fuzzer, must be a power of 2
+#define COVERAGE_SIZE 65536
+
+//reasons for the CPU to stop executing, instead of killing the whole process
+enum CrashType{
+    CRASH_NONE = 0,
+    CRASH_INVALID_OPCODE,
+    CRASH_STACK_OVERFLOW,
+    CRASH_STACK_UNDERFLOW
+};
+
+const char *crashName(CrashType type);
+
 class CPU{
 private:
     uint16_t stack[16]; //stack
     uint16_t sp; //stack pointer
 
-    uint8_t memory[4096]; //chip 8 has 4 kilobytes of memory
+    std::vector<uint8_t> memory; //chip 8 has 4 kilobytes of memory, XO-CHIP has 64, plus MEMORY_PADDING. copying the CPU copies only that much
+    uint32_t memorySize; //MEMORY_SIZE_CHIP8 or MEMORY_SIZE_XOCHIP
+    uint32_t memoryMask; //every address is ANDed with this, so it wraps around instead of going out of bounds
     uint8_t V[16]; //on Chip 8, registers are represented with V[0 t F], there are 16 of them
 
     uint8_t st; //sound timer
@@ -44,17 +68,38 @@ private:
     uint16_t pc; //16 bits program counter
     uint16_t I; //index register 
 
+    uint32_t rngState; //random number generator for CXNN, part of the CPU state so that saved states replay the same numbers
+
+    uint16_t prevLoc; //hashed location of the previous instruction, used for edge coverage
+
+    //zobrist hashes of memory and frame, kept up to date on every write so that stateHash() doesn't have to rehash them
+    uint64_t memoryHash;
+    uint64_t frameHash;
+
     void init();
+    void trap(CrashType type);
+    void writeMemory(uint16_t address, const uint8_t *data, int length);
+    uint64_t registerHash() const;
 
 public:
     //constructor and destructor functions
-    CPU();
+    CPU(bool xochip = false);
     ~CPU();
 
     uint8_t frame[64*32]; //for graphics, chip 8 supports 64x32 pixels, 64 pixels wide and 32 bit pixels in height
     uint8_t keypad[16]; //there 16 keypad buttons supported by chip 8
     bool drawFlag; //draw flag of chip 8 to update screen
 
+    CrashType crash; //set when the program does something invalid, execute() does nothing after that
+    uint16_t crashPC; //address of the instruction that crashed
+    uint16_t crashOpcode; //the instruction that crashed
+    uint32_t frameOverdraws; //pixels of sprites that were clipped because they ran past the end of the frame buffer
+
+    uint8_t *coverage; //optional edge coverage bitmap of COVERAGE_SIZE bytes, updated on every instruction if not nullptr
+
     void execute();
+    uint64_t stateHash() const;
+    uint64_t computeStateHash() const;
     int loadROM(const char *rom_path);
+    int loadROM(const uint8_t *rom, int rom_size);
 };
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <string.h>
 #include <SDL2/SDL.h>
 #include <windows.h>
 #include <thread>
@@ -26,13 +27,55 @@ uint8_t keymap[16] = {
     SDLK_v,
 };
 
+//the CPU runs this many instructions between two frames, at 60 frames per second that's the old ~1 instruction per millisecond
+#define CYCLES_PER_FRAME 16
+
+//run one frame worth of instructions
+void runFrame(CPU &cpu){
+    for(int i=0; i<CYCLES_PER_FRAME; i++){
+        cpu.execute();
+    }
+}
+
+//copy the frame buffer of the CPU to the screen
+void drawFrame(RenderWindow &window, SDL_Texture *texture, CPU &cpu, uint32_t pixels[]){
+    //store frame buffer in our temporary pixel buffer
+    for(int i=0; i<64*32; i++){
+        uint8_t pixel = cpu.frame[i];
+        pixels[i] = (0x00FFFFFF * pixel) | 0xFF000000;
+    }
+
+    //update the texture with the new pixels
+    window.updateTexture(texture, pixels);
+
+    //clear the screen
+    window.clear();
+    //render the texture
+    window.render(texture);
+    //display it
+    window.display();
+}
+
 int main(int argc, char *argv[]){
-    if(argc != 2){
-        std::cout << "Usage : main <ROM file>" << std::endl;
+    if(argc < 2){
+        std::cout << "Usage : main <ROM file> [--run-ahead N] [--xochip]" << std::endl;
         return 1;
     }
 
-    CPU cpu = CPU(); //create the CPU object
+    //with run-ahead, every frame shows where the game will be this many frames later with the current keys,
+    //which hides the frames of input lag most games have between reading a key and drawing the result
+    int run_ahead = 0;
+    bool xochip = false; //XO-CHIP ROMs get 64 KB of memory instead of 4
+
+    for(int i=2; i<argc; i++){
+        if(strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc)
+            run_ahead = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--xochip") == 0)
+            xochip = true;
+    }
+
+    CPU cpu = CPU(xochip); //create the CPU object
+    CPU saved = CPU(xochip); //snapshot for run-ahead, kept outside the loop so its memory is allocated once
 
     if(SDL_Init(SDL_INIT_VIDEO) < 0){
         std::cout << "Could not initialize SDL. " << SDL_GetError();
@@ -51,8 +94,6 @@ int main(int argc, char *argv[]){
     
     //execution loop
     while(true){
-        cpu.execute();
-
         SDL_Event e;
 
         while(SDL_PollEvent(&e)){
@@ -80,34 +121,41 @@ int main(int argc, char *argv[]){
             }
         }
 
-        //if drawFlag is set to true, re-render the SDL screen
-        if(cpu.drawFlag){
-            cpu.drawFlag = false; //set back to false
+        runFrame(cpu);
 
-            //store frame buffer in our temporary pixel buffer
-            for(int i=0; i<64*32; i++){
-                uint8_t pixel = cpu.frame[i];
-                pixels[i] = (0x00FFFFFF * pixel) | 0xFF000000;
-            }
+        //the CPU does not exit on its own anymore, stop here if the ROM did something invalid
+        if(cpu.crash != CRASH_NONE){
+            printf("\nCPU crashed (%s) at %.4X, opcode: %.4X\n", crashName(cpu.crash), cpu.crashPC, cpu.crashOpcode);
+            exit(3);
+        }
+
+        if(run_ahead > 0){
+            //save the CPU, run ahead with the keys that are held right now, show that frame and go back.
+            //the CPU is plain data of a few kilobytes, so copying it is much cheaper than the frames we run
+            saved = cpu;
 
-            //update the texture with the new pixels
-            window.updateTexture(texture, pixels);
+            for(int i=0; i<run_ahead; i++){
+                runFrame(cpu);
+            }
 
-            //clear the screen
-            window.clear();
-            //render the texture
-            window.render(texture);
-            //display it
-            window.display();
+            //the speculative frame can change even when the real one didn't, so always draw it
+            drawFrame(window, texture, cpu, pixels);
 
+            cpu = saved;
+            cpu.drawFlag = false;
+        }
+        //if drawFlag is set to true, re-render the SDL screen
+        else if(cpu.drawFlag){
+            cpu.drawFlag = false; //set back to false
+            drawFrame(window, texture, cpu, pixels);
         }
 
         //to slow down the emulation, I had to use this function. 
         //For some reason sleep function from std::thread is not working on my windows 10.
-        Sleep(1);
+        Sleep(16);
 
         //comment the above line and uncomment the below line, if you are on linux
-        //std::this_thread::sleep_for(std::chrono::microseconds(1000));
+        //std::this_thread::sleep_for(std::chrono::microseconds(16000));
     }
 
     window.cleanUp();